@@ -1,11 +1,16 @@
 #include "chip8.h"
+#include "chip8_ext.h"
 
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 static int _timespec_subtract(struct timespec* result, struct timespec* x, struct timespec* y);
 
+/* Trap table used while no debugger is attached */
+static unsigned char _chip8_no_traps[CHIP8_ADDR_SPACE];
+
 /* Memory map
    0x000 - 0x1FF - Chip 8 intrpreter (contains fron set in emu)
    0x050 - 0x0A0 - Used for built in 4x5 pixel font set (0 - F)
@@ -33,17 +38,61 @@ unsigned char fontset[80] =
 };
 
 
-// Set memory and registers to 0
+#define FRAME_NSEC 16666667
+
+/* Every opcode is one cycle, so the budget is an instruction count */
+static const unsigned short _chip8_fixed_cost[NUM_OPS] =
+{
+    [OP_CLS] = 1, [OP_RET] = 1, [OP_SYS] = 1, [OP_JP] = 1, [OP_CALL] = 1,
+    [OP_SE_BYTE] = 1, [OP_SE_REG] = 1, [OP_LD_BYTE] = 1, [OP_ADD_BYTE] = 1,
+    [OP_ALU] = 1, [OP_LD_I] = 1, [OP_JP_V0] = 1, [OP_RND] = 1, [OP_DRW] = 1,
+    [OP_SKP] = 1, [OP_LD_TIMER] = 1, [OP_LD_K] = 1, [OP_ADD_I] = 1,
+    [OP_LD_F] = 1, [OP_LD_B] = 1, [OP_LD_REGS] = 1
+};
+
+/* Approximate machine cycles (8 clocks) taken by the original COSMAC VIP
+   interpreter, including fetch and decode */
+static const unsigned short _chip8_vip_cost[NUM_OPS] =
+{
+    [OP_CLS] = 24, [OP_RET] = 23, [OP_SYS] = 23, [OP_JP] = 23, [OP_CALL] = 23,
+    [OP_SE_BYTE] = 12, [OP_SE_REG] = 16, [OP_SKIP] = 2, [OP_LD_BYTE] = 6,
+    [OP_ADD_BYTE] = 10, [OP_ALU] = 44, [OP_LD_I] = 12, [OP_JP_V0] = 23,
+    [OP_RND] = 36, [OP_DRW] = 26, [OP_DRW_ROW] = 14, [OP_DRW_SHIFT] = 4,
+    [OP_DRW_SPLIT] = 10, [OP_SKP] = 16, [OP_LD_TIMER] = 10, [OP_LD_K] = 10,
+    [OP_ADD_I] = 19, [OP_LD_F] = 20, [OP_LD_B] = 204, [OP_LD_REGS] = 14,
+    [OP_LD_REGS_EACH] = 14
+};
+
+// Set memory and registers to 0. An instance in an extended mode has to be
+// put back with chip8_set_mode(op_chip, CHIP8_MODE_CHIP8) first, which frees
+// its extended state.
 void chip8_initialize_system(struct chip8 *op_chip)
 {
     memset(op_chip->memory, 0, MEMORY_SIZE * sizeof(unsigned char));
     memset(op_chip->V, 0, NUM_REGISTERS * sizeof(unsigned char));
     memset(op_chip->screen, 0, SCREEN_SIZE * sizeof(unsigned char));
+    op_chip->dirty = 1;
     op_chip->I = 0x0;
     op_chip->pc = 0x200;
     op_chip->delay_timer = 0;
     op_chip->sound_timer = 0;
     op_chip->sp = 0;
+    op_chip->mem = op_chip->memory;
+    op_chip->mem_mask = MEMORY_MASK;
+    op_chip->ext = NULL;
+    op_chip->trap = _chip8_no_traps;
+    op_chip->trap_handler = NULL;
+    op_chip->trap_ctx = NULL;
+
+    // One instruction per frame, unpaced
+    op_chip->timing = CHIP8_TIMING_FIXED;
+    op_chip->cost = _chip8_fixed_cost;
+    op_chip->cycle_budget = 1;
+    op_chip->cycles = 0;
+    op_chip->paced = 0;
+    op_chip->halted = 0;
+    op_chip->instructions = 0;
+    op_chip->draws = 0;
     srand(time(NULL));
     for(int i = 0; i < 80; i++)
     {
@@ -61,36 +110,99 @@ static void _chip8_done(const char* reason, unsigned short opcode)
     exit(1);
 }
 
+/* Stop one instance without taking down the others in the process */
+__attribute__((cold)) void chip8_halt(struct chip8 *op_chip, unsigned short opcode)
+{
+    fprintf(stderr, "Error [0x%4X]: Opcode not found\n", opcode);
+    op_chip->halted = 1;
+}
+
+// Install a debugger trap table, or remove it if trap is NULL
+void chip8_attach_traps(struct chip8 *op_chip, unsigned char *trap,
+                        void (*handler) (struct chip8 *op_chip, unsigned char kind, unsigned short addr),
+                        void *ctx)
+{
+    if(trap == NULL)
+    {
+        op_chip->trap = _chip8_no_traps;
+        op_chip->trap_handler = NULL;
+        op_chip->trap_ctx = NULL;
+        return;
+    }
+    op_chip->trap = trap;
+    op_chip->trap_handler = handler;
+    op_chip->trap_ctx = ctx;
+}
+
+/* Report a memory access to the debugger if the address is watched */
+static inline void _chip8_watch(struct chip8 *op_chip, unsigned short addr, unsigned char kind)
+{
+    if(op_chip->trap[addr] & kind)
+    {
+        op_chip->trap_handler(op_chip, kind, addr);
+    }
+}
+
 // Put program into memory
 void chip8_load_program(struct chip8 *op_chip, char* buffer, size_t buf_size)
 {
+    if(buf_size > op_chip->mem_mask + 1 - 0x200)
+    {
+        buf_size = op_chip->mem_mask + 1 - 0x200;
+    }
     for(int i = 0; i < buf_size; i++)
     {
-        op_chip->memory[0x200 + i] = buffer[i]; // Program memory starts at 0x200
+        op_chip->mem[0x200 + i] = buffer[i]; // Program memory starts at 0x200
     }
 }
 
-// Emulate chip8
-void chip8_run(struct chip8 *op_chip)
+// Select how opcodes are costed and how many cycles make up a frame
+void chip8_set_timing(struct chip8 *op_chip, unsigned char timing, unsigned int ipf)
 {
-    struct timespec time_start, time_end, time_diff;
-    struct timespec time_60_htz;
+    op_chip->timing = timing;
+    op_chip->cycles = 0;
+    op_chip->paced = 1;
+    if(timing == CHIP8_TIMING_VIP)
+    {
+        op_chip->cost = _chip8_vip_cost;
+        op_chip->cycle_budget = VIP_CYCLES_PER_FRAME - VIP_CYCLES_DMA - VIP_CYCLES_INTERRUPT;
+    }
+    else
+    {
+        op_chip->cost = _chip8_fixed_cost;
+        op_chip->cycle_budget = ipf > 0 ? ipf : 1;
+    }
+}
+
+/* The interpreter loop, shared by both machines. ext is always a constant,
+   so the base machine's copy compiles without any of the extended paths
+   and keeps addressing its own 4K directly. */
+static inline __attribute__((always_inline)) char _chip8_frame(struct chip8 *op_chip, const int ext)
+{
+    const unsigned short *cost = op_chip->cost;
+    unsigned int cycles = op_chip->cycles;
+    unsigned char *mem = ext ? op_chip->mem : op_chip->memory;
+    const unsigned int mask = ext ? op_chip->mem_mask : MEMORY_MASK;
+    unsigned int executed = 0;
     unsigned short opcode;
     char redraw = 0;
 
-    time_60_htz.tv_sec = 0;
-    time_60_htz.tv_nsec = 1666666;
-
-    for(;;)
+    while(cycles < op_chip->cycle_budget)
     {
+        executed++;
+
+        // Addresses are masked rather than checked, so a wild ROM wraps
+        // around inside its own memory instead of writing past it
+        op_chip->pc &= mask;
 
-//        if(clock_gettime(CLOCK_MONOTONIC, &time_start))
-//        {
-//            _chip8_done("Cannot get time", opcode);
-//        }
+        // Breakpoints and single-step
+        if(op_chip->trap[op_chip->pc])
+        {
+            op_chip->trap_handler(op_chip, op_chip->trap[op_chip->pc], op_chip->pc);
+        }
 
         // Get next opcode
-        opcode = op_chip->memory[op_chip->pc] << 8 | op_chip->memory[op_chip->pc + 1];
+        opcode = mem[op_chip->pc] << 8 | mem[(op_chip->pc + 1) & mask];
 
         switch(opcode & 0xF000)
         {
@@ -100,17 +212,42 @@ void chip8_run(struct chip8 *op_chip)
                 {
                     case 0x00E0: // 0x00E0 - CLS
                         // Clear Screen
-                        memset(op_chip->screen, 0, SCREEN_SIZE * sizeof(unsigned char));
+                        cycles += cost[OP_CLS];
+                        if(ext)
+                        {
+                            chip8_ext_clear(op_chip);
+                        }
+                        else
+                        {
+                            memset(op_chip->screen, 0, SCREEN_SIZE * sizeof(unsigned char));
+                            op_chip->dirty = 1;
+                        }
                         op_chip->pc += 2;
                         break;
 
                     case 0x00EE: // 0x00EE - RET
                         // Return
+                        cycles += cost[OP_RET];
                         op_chip->sp--;
-                        op_chip->pc = op_chip->stack[op_chip->sp];
+                        op_chip->pc = op_chip->stack[op_chip->sp & STACK_MASK];
                         op_chip->pc += 2;
                         break;
 
+                    default: // 0x0nnn - SYS
+                        // Machine code routines are not supported and are
+                        // skipped, the extended modes keep their own opcodes here
+                        cycles += cost[OP_SYS];
+                        int result = ext ? chip8_ext_exec(op_chip, opcode) : EXT_UNKNOWN;
+                        if(result == EXT_UNKNOWN)
+                        {
+                            op_chip->pc += 2;
+                        }
+                        else if(result == EXT_HALT)
+                        {
+                            cycles = op_chip->cycle_budget;
+                        }
+                        break;
+
 //                    default:
 //                        printf("ERROR [0x%X]: The SYS opcode is not supported.\n",  opcode);
 //                        exit(1);
@@ -119,51 +256,65 @@ void chip8_run(struct chip8 *op_chip)
 
             case 0x1000: // 0x1nnn - JP
                 // Jump to address 0x0nnn
+                cycles += cost[OP_JP];
                 op_chip->pc = opcode & 0x0FFF;
                 break;
 
             case 0x2000: // 0x2nnn - CALL
                 // Call subroutine at 0x0nnn
-                op_chip->stack[op_chip->sp] = op_chip->pc;
+                cycles += cost[OP_CALL];
+                op_chip->stack[op_chip->sp & STACK_MASK] = op_chip->pc;
                 op_chip->sp++;
                 op_chip->pc = opcode & 0x0FFF;
                 break;
 
             case 0x3000: // 0x3xkk - SE Vx, byte
                 // Skip next opcode if Vx == 0xkk
+                cycles += cost[OP_SE_BYTE];
                 if( op_chip->V[ (opcode & 0x0F00) >> 8 ] == (opcode & 0x00FF) )
                 {
-                    op_chip->pc += 2;
+                    cycles += cost[OP_SKIP];
+                    op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                 }
                 op_chip->pc += 2;
                 break;
 
             case 0x4000: // 0x4xkk - SNE Vx, byte
                 //Skip next opcode if Vx != 0xkk
+                cycles += cost[OP_SE_BYTE];
                 if( op_chip->V[ (opcode & 0x0F00) >> 8 ] != (opcode & 0x00FF) )
                 {
-                    op_chip->pc += 2;
+                    cycles += cost[OP_SKIP];
+                    op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                 }
                 op_chip->pc += 2;
                 break;
 
             case 0x5000: // 0x5xy0 - SE Vx, Vy
                 //Skip next opcode if Vx == Vy
+                cycles += cost[OP_SE_REG];
+                if(ext && (opcode & 0x000F) && chip8_ext_exec(op_chip, opcode) != EXT_UNKNOWN)
+                {
+                    break;
+                }
                 if( op_chip->V[ (opcode & 0x0F00) >> 8 ] == op_chip->V[ (opcode & 0x00F0) >> 4 ] )
                 {
-                    op_chip->pc += 2;
+                    cycles += cost[OP_SKIP];
+                    op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                 }
                 op_chip->pc += 2;
                 break;
 
             case 0x6000: // 0x6xkk - LD Vx, byte
                 // Set Vx to 0xkk
+                cycles += cost[OP_LD_BYTE];
                 op_chip->V[ (opcode & 0x0F00) >> 8 ] = opcode & 0x00FF;
                 op_chip->pc += 2;
                 break;
 
             case 0x7000: // 0x7xkk - ADD Vx, byte
                 // Add byte to Vx and set Vx to result
+                cycles += cost[OP_ADD_BYTE];
                 op_chip->V[ (opcode & 0x0F00) >> 8 ] += opcode & 0x00FF;
                 op_chip->pc += 2;
                 break;
@@ -174,30 +325,35 @@ void chip8_run(struct chip8 *op_chip)
                 {
                     case 0x0000: // 0x8xy0 - LD Vx, Vy
                         // Stores Vy in Vx
+                        cycles += cost[OP_ALU];
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] = op_chip->V[ (opcode & 0x00F0) >> 4 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0001: // 0x8xy1 - OR Vx, Vy
                         // ORs Vx and Vy and stores in Vx
+                        cycles += cost[OP_ALU];
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] |= op_chip->V[ (opcode & 0x00F0) >> 4 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0002: // 0x8xy2 - AND Vx, Vy
                         // ANDs Vx and Vy and stores in Vx
+                        cycles += cost[OP_ALU];
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] &= op_chip->V[ (opcode & 0x00F0) >> 4 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0003: // 0x8xy3 - XOR Vx, Vy
                         // XORs Vx and Vy and stores in Vx
+                        cycles += cost[OP_ALU];
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] ^= op_chip->V[ (opcode & 0x00F0) >> 4 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0004: // 0x8xy4 - ADD Vx, Vy
                         // ADDs Vy to Vx. Sets VF if carry
+                        cycles += cost[OP_ALU];
                         if( op_chip->V[ (opcode & 0x0F00) >> 8 ] > (0x00FF - op_chip->V[ (opcode & 0x00F0) >> 4]) )
                         {
                             op_chip->V[0xF] = 1;
@@ -212,6 +368,7 @@ void chip8_run(struct chip8 *op_chip)
 
                     case 0x0005: // 0x8xy5 - SUB Vx, Vy
                         // Subtracts Vy from Vx and stores in Vx. Sets VF if NOT borrow
+                        cycles += cost[OP_ALU];
                         if( op_chip->V[ (opcode & 0x0F00) >> 8 ] < op_chip->V[ (opcode & 0x00F0) >> 4] )
                         {
                             op_chip->V[0xF] = 0;
@@ -226,6 +383,7 @@ void chip8_run(struct chip8 *op_chip)
 
                     case 0x0006: // 0x8xy6 - SHR Vx {, Vy}
                         // Puts LSB in VF and shifts Vx right by one
+                        cycles += cost[OP_ALU];
                         op_chip->V[0xF] = op_chip->V[ (opcode & 0x0F00) >> 8 ] & 0x0001;
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] >>= 1;
                         op_chip->pc += 2;
@@ -233,6 +391,7 @@ void chip8_run(struct chip8 *op_chip)
 
                     case 0x0007: // 0x8xy7 - SUBN Vx, Vy
                         // Subtracts Vx from Vy and stores in Vx. Sets VF if NOT borrow
+                        cycles += cost[OP_ALU];
                         if( op_chip->V[ (opcode & 0x00F0) >> 4 ] < op_chip->V[ (opcode & 0x0F00) >> 8] )
                         {
                             op_chip->V[0xF] = 0;
@@ -247,38 +406,45 @@ void chip8_run(struct chip8 *op_chip)
 
                     case 0x000E: // 0x8xyE - SHL Vx {, Vy}
                         // Puts MSB in VF and shifts Vx left by one
+                        cycles += cost[OP_ALU];
                         op_chip->V[0xF] = op_chip->V[ (opcode & 0x0F00) >> 8 ] >> 7;
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] <<= 1;
                         op_chip->pc += 2;
                         break;
 
                     default:
-                        _chip8_done("Opcode not found", opcode);
+                        chip8_halt(op_chip, opcode);
+                        cycles = op_chip->cycle_budget;
                 }
                 break;
 
             case 0x9000: // 0x9xy0 - SNE Vx, Vy
                 // Skip next opcode if Vx != Vy
+                cycles += cost[OP_SE_REG];
                 if( op_chip->V[ (opcode & 0x0F00) >> 8 ] != op_chip->V[ (opcode & 0x00F0) >> 4] )
                 {
-                    op_chip->pc += 2;
+                    cycles += cost[OP_SKIP];
+                    op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                 }
                 op_chip->pc += 2;
                 break;
 
             case 0xA000: // 0xAnnn - LD I, addr
                 // Sets I to 0xnnn
+                cycles += cost[OP_LD_I];
                 op_chip->I = opcode & 0x0FFF;
                 op_chip->pc += 2;
                 break;
 
             case 0xB000: // 0xBnnn - JP V0, addr
                 // Sets pc to 0xnnn + V0
+                cycles += cost[OP_JP_V0];
                 op_chip->pc = (opcode & 0x0FFF) + op_chip->V[0x0];
                 break;
 
             case 0xC000: // 0xCxkk - RND Vx, byte
                 // Sets Vx to a random number ANDed by 0xkk
+                cycles += cost[OP_RND];
                 op_chip->V[ (opcode & 0x0F00) >> 8 ] = rand() & opcode & 0x00FF;
                 op_chip->pc += 2;
                 break;
@@ -286,26 +452,50 @@ void chip8_run(struct chip8 *op_chip)
             case 0xD000: // 0xDxyn - DRW Vx, Vy, nibble
                 // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
                 redraw = 1;
+                op_chip->dirty = 1;
+                op_chip->draws++;
                 op_chip->V[0xF] = 0;
                 unsigned int x_major = op_chip->V[(opcode & 0x0F00) >> 8];
                 unsigned int y_major = op_chip->V[(opcode & 0x00F0) >> 4];
-                for(int y = 0; y < (opcode & 0x000F); y++)
+
+                // Rows cost more when the sprite has to be shifted into place
+                // and straddles two bytes of the display
+                unsigned int draw_cost = cost[OP_DRW] + (opcode & 0x000F) *
+                          (cost[OP_DRW_ROW] + (x_major & 7) * cost[OP_DRW_SHIFT] +
+                           ((x_major & 7) != 0) * cost[OP_DRW_SPLIT]);
+                cycles += draw_cost;
+                if(ext)
+                {
+                    op_chip->V[0xF] = chip8_ext_draw(op_chip, x_major, y_major, opcode & 0x000F);
+                }
+                else
                 {
-                    for(int x = 0; x < 8; x++)
+                    for(int y = 0; y < (opcode & 0x000F); y++)
                     {
-                        /* If there is a pixel to update and it isn't off the bottom of the screen */
-                        if((op_chip->memory[op_chip->I + y] & (0x80 >> x)) &&
-                           (y_major + y + ((x_major + x) / SCREEN_WIDTH)) < SCREEN_HEIGHT)
+                        _chip8_watch(op_chip, (op_chip->I + y) & mask, CHIP8_TRAP_READ);
+                        for(int x = 0; x < 8; x++)
                         {
-                            if(op_chip->screen[(y_major + y) * SCREEN_WIDTH + x_major + x])
+                            /* If there is a pixel to update and it isn't off the bottom of the screen */
+                            if((mem[(op_chip->I + y) & mask] & (0x80 >> x)) &&
+                               (y_major + y + ((x_major + x) / SCREEN_WIDTH)) < SCREEN_HEIGHT)
                             {
-                                op_chip->V[0xF] = 1;
+                                if(op_chip->screen[(y_major + y) * SCREEN_WIDTH + x_major + x])
+                                {
+                                    op_chip->V[0xF] = 1;
+                                }
+                                op_chip->screen[(y_major + y) * SCREEN_WIDTH + x_major + x] ^= 1;
                             }
-                            op_chip->screen[(y_major + y) * SCREEN_WIDTH + x_major + x] ^= 1;
                         }
                     }
                 }
                 op_chip->pc += 2;
+
+                // The VIP waits for the display interrupt before drawing, so
+                // the sprite ends the frame and its cost carries into the next
+                if(op_chip->timing == CHIP8_TIMING_VIP)
+                {
+                    cycles = op_chip->cycle_budget + draw_cost;
+                }
                 break;
 
             case 0xE000:
@@ -313,24 +503,29 @@ void chip8_run(struct chip8 *op_chip)
                 {
                     case 0x009E: // 0xEx9E - SKP Vx
                         // Skip next instruction if key Vx is pressed
-                        if( op_chip->key[ op_chip->V[ (opcode & 0x0F00) >> 8 ] ] != 0 )
+                        cycles += cost[OP_SKP];
+                        if( op_chip->key[ op_chip->V[ (opcode & 0x0F00) >> 8 ] & (NUM_KEYS - 1) ] != 0 )
                         {
-                            op_chip->pc += 2;
+                            cycles += cost[OP_SKIP];
+                            op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                         }
                         op_chip->pc += 2;
                         break;
 
                     case 0x00A1: // SKNP Vx
                         // Skip next instruction if key Vx is NOT pressed
-                        if( op_chip->key[ op_chip->V[ (opcode & 0x0F00) >> 8 ] ] == 0 )
+                        cycles += cost[OP_SKP];
+                        if( op_chip->key[ op_chip->V[ (opcode & 0x0F00) >> 8 ] & (NUM_KEYS - 1) ] == 0 )
                         {
-                            op_chip->pc += 2;
+                            cycles += cost[OP_SKIP];
+                            op_chip->pc += ext ? chip8_ext_skip(op_chip) : 2;
                         }
                         op_chip->pc += 2;
                         break;
 
                     default:
-                        _chip8_done("Opcode not found", opcode);
+                        chip8_halt(op_chip, opcode);
+                        cycles = op_chip->cycle_budget;
                 }
                 break;
 
@@ -339,37 +534,46 @@ void chip8_run(struct chip8 *op_chip)
                 {
                     case 0x0007: // 0xFx07 - LD Vx, DT
                         // Puts the value of the delay timer in Vx
+                        cycles += cost[OP_LD_TIMER];
                         op_chip->V[ (opcode & 0x0F00) >> 8 ] = op_chip->delay_timer;
                         op_chip->pc += 2;
                         break;
 
                     case 0x000A: // 0xFx0A - LD Vx, K
                         // Waits for a keypress and puts the value in Vx
-                        op_chip->V[ (opcode & 0x0F00) >> 8 ] = op_chip->get_key(op_chip);
+                        cycles += cost[OP_LD_K];
+                        unsigned char pressed = op_chip->get_key(op_chip);
+                        if(pressed >= NUM_KEYS)
+                        {
+                            // Nothing pressed yet, retry on the next frame
+                            cycles = op_chip->cycle_budget;
+                            break;
+                        }
+                        op_chip->V[ (opcode & 0x0F00) >> 8 ] = pressed;
                         op_chip->pc += 2;
                         break;
 
                     case 0x0015: // 0xFx15 - LD DT, Vx
                         // Sets delay timer to Vx
+                        cycles += cost[OP_LD_TIMER];
                         op_chip->delay_timer = op_chip->V[ (opcode & 0x0F00) >> 8 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0018: // 0xFx18 - LD ST, Vx
                         // Sets sound timer to Vx
+                        cycles += cost[OP_LD_TIMER];
                         op_chip->sound_timer = op_chip->V[ (opcode & 0x0F00) >> 8 ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x001E: // 0xFx1E - ADD I, Vx
-                        // Increments I by Vx
-                        if(op_chip->I + op_chip->V[ (opcode & 0x0F00) >> 8 ] > 0xFFF)
-                        {
-                            op_chip->V[0xF] = 1;
-                        }
-                        else
+                        // Increments I by Vx. SUPER-CHIP and XO-CHIP leave VF
+                        // alone, I can legitimately point past 0xFFF there
+                        cycles += cost[OP_ADD_I];
+                        if(!ext)
                         {
-                            op_chip->V[0xF] = 0;
+                            op_chip->V[0xF] = op_chip->I + op_chip->V[ (opcode & 0x0F00) >> 8 ] > 0xFFF;
                         }
                         op_chip->I += op_chip->V[ (opcode & 0x0F00) >> 8 ];
                         op_chip->pc += 2;
@@ -377,75 +581,193 @@ void chip8_run(struct chip8 *op_chip)
 
                     case 0x0029: // 0xFx29 - LD F, Vx
                         // Set I to the location of the sprite for digit Vx
+                        cycles += cost[OP_LD_F];
                         op_chip->I = 5 * op_chip->V[ ((opcode & 0x0F00) >> 8) ];
                         op_chip->pc += 2;
                         break;
 
                     case 0x0033: // 0xFx33 - LD B, Vx
                         // Stores the BCD representation of Vx in memory locations I, I+1, I+2
-                        op_chip->memory[op_chip->I] = op_chip->V[ (opcode & 0x0F00) >> 8 ] / 100;
-                        op_chip->memory[op_chip->I + 1] = op_chip->V[ (opcode & 0x0F00) >> 8 ] / 10 % 10;
-                        op_chip->memory[op_chip->I + 2] = op_chip->V[ (opcode & 0x0F00) >> 8 ] % 10;
+                        cycles += cost[OP_LD_B];
+                        _chip8_watch(op_chip, op_chip->I & mask, CHIP8_TRAP_WRITE);
+                        _chip8_watch(op_chip, (op_chip->I + 1) & mask, CHIP8_TRAP_WRITE);
+                        _chip8_watch(op_chip, (op_chip->I + 2) & mask, CHIP8_TRAP_WRITE);
+                        mem[op_chip->I & mask] = op_chip->V[ (opcode & 0x0F00) >> 8 ] / 100;
+                        mem[(op_chip->I + 1) & mask] = op_chip->V[ (opcode & 0x0F00) >> 8 ] / 10 % 10;
+                        mem[(op_chip->I + 2) & mask] = op_chip->V[ (opcode & 0x0F00) >> 8 ] % 10;
                         op_chip->pc += 2;
                         break;
 
                     case 0x0055: // 0xFx55 - LD [I], Vx
                         // Stores registers V0 through Vx starting at address I
+                        cycles += cost[OP_LD_REGS] + ((opcode & 0x0F00) >> 8) * cost[OP_LD_REGS_EACH];
                         for(int i = 0; i <= (opcode & 0x0F00) >> 8; i++)
                         {
-                            op_chip->memory[op_chip->I + i] = op_chip->V[i];
+                            _chip8_watch(op_chip, (op_chip->I + i) & mask, CHIP8_TRAP_WRITE);
+                            mem[(op_chip->I + i) & mask] = op_chip->V[i];
                         }
                         op_chip->pc += 2;
                         break;
 
                     case 0x0065: // 0xFx65 - LD Vx, [I]
                         // Reads registers V0 through Vx starting at address I
+                        cycles += cost[OP_LD_REGS] + ((opcode & 0x0F00) >> 8) * cost[OP_LD_REGS_EACH];
                         for(int i = 0; i <= (opcode & 0x0F00) >> 8; i++)
                         {
-                            op_chip->V[i] = op_chip->memory[op_chip->I + i];
+                            _chip8_watch(op_chip, (op_chip->I + i) & mask, CHIP8_TRAP_READ);
+                            op_chip->V[i] = mem[(op_chip->I + i) & mask];
                         }
                         op_chip->pc += 2;
                         break;
 
                     default:
-                        _chip8_done("Opcode not found", opcode);
+                        if(ext && chip8_ext_exec(op_chip, opcode) != EXT_UNKNOWN)
+                        {
+                            cycles += cost[OP_SYS];
+                            break;
+                        }
+                        chip8_halt(op_chip, opcode);
+                        cycles = op_chip->cycle_budget;
                 }
                 break;
         }
+    }
+    op_chip->cycles = cycles - op_chip->cycle_budget;
+    op_chip->instructions += executed;
+
+    if(op_chip->delay_timer > 0)
+    {
+        --op_chip->delay_timer;
+    }
+    if(op_chip->sound_timer > 0)
+    {
+        --op_chip->sound_timer;
+    }
 
+    // Extended modes also scroll, which only shows up in dirty
+    return ext ? op_chip->dirty : redraw;
+}
+
+/* Kept out of line so the base machine's loop is not merged with it */
+static __attribute__((noinline)) char _chip8_ext_frame(struct chip8 *op_chip)
+{
+    return _chip8_frame(op_chip, 1);
+}
+
+// Run instructions until the frame's cycle budget is spent
+char chip8_run_frame(struct chip8 *op_chip)
+{
+    if(op_chip->halted)
+    {
+        return 0;
+    }
+    if(op_chip->ext)
+    {
+        return _chip8_ext_frame(op_chip);
+    }
+    return _chip8_frame(op_chip, 0);
+}
+
+// Sleep until the next 60 Hz frame, without trying to catch up when behind
+static void _chip8_pace(struct timespec *deadline)
+{
+    struct timespec now, diff;
+
+    deadline->tv_nsec += FRAME_NSEC;
+    if(deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_nsec -= 1000000000;
+        deadline->tv_sec++;
+    }
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now))
+    {
+        _chip8_done("Cannot get time", 0);
+    }
+
+    if(_timespec_subtract(&diff, deadline, &now))
+    {
+        clock_gettime(CLOCK_MONOTONIC, deadline);
+        return;
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+}
 
-        if(op_chip->delay_timer > 0)
+// Emulate chip8
+void chip8_run(struct chip8 *op_chip)
+{
+    struct timespec deadline;
+    char redraw;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &deadline))
+    {
+        _chip8_done("Cannot get time", 0);
+    }
+
+    for(;;)
+    {
+        redraw = chip8_run_frame(op_chip);
+        if(op_chip->halted)
         {
-            --op_chip->delay_timer;
+            return;
         }
-        if(op_chip->sound_timer > 0)
+        op_chip->end_of_cycle(op_chip, redraw);
+
+        if(op_chip->paced)
         {
-            --op_chip->sound_timer;
+            _chip8_pace(&deadline);
         }
+    }
+}
 
-        op_chip->end_of_cycle(op_chip, redraw);
-        redraw = 0;
-
-//        if(clock_gettime(CLOCK_MONOTONIC, &time_end))
-//        {
-//            _chip8_done("Cannot get time end", opcode);
-//        }
-//
-//        if(_timespec_subtract(&time_diff, &time_end, &time_start))
-//        {
-//            _chip8_done("Cannot get time diff", opcode);
-//        }
-//
-//        if(_timespec_subtract(&time_diff, &time_60_htz, &time_diff))
-//        {
-//            continue;
-//        }
-//
-//        if(nanosleep(&time_diff, NULL))
-//        {
-//            continue;
-//        }
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+// Map room for count instances, on huge pages when the system has them
+int chip8_pool_create(struct chip8_pool *pool, size_t count)
+{
+    size_t size = count * sizeof(struct chip8);
+    void *base;
+
+    size = (size + POOL_HUGE_PAGE - 1) & ~(size_t) (POOL_HUGE_PAGE - 1);
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(base == MAP_FAILED)
+    {
+        // No reserved huge pages, fall back to transparent ones
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED)
+        {
+            return 1;
+        }
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    pool->base = base;
+    pool->size = size;
+    pool->count = count;
+    return 0;
+}
+
+struct chip8 *chip8_pool_get(struct chip8_pool *pool, size_t index)
+{
+    if(index >= pool->count)
+    {
+        return NULL;
+    }
+    return (struct chip8 *) pool->base + index;
+}
+
+void chip8_pool_destroy(struct chip8_pool *pool)
+{
+    // Instances are zeroed by mmap, so ext is NULL unless set_mode ran
+    for(size_t i = 0; i < pool->count; i++)
+    {
+        chip8_set_mode(chip8_pool_get(pool, i), CHIP8_MODE_CHIP8);
     }
+    munmap(pool->base, pool->size);
+    pool->base = NULL;
+    pool->count = 0;
 }
 
 /* Subtract the `struct timeval' values X and Y,
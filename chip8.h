@@ -1,3 +1,6 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
 #include <stdio.h>
 
 #define MEMORY_SIZE 4096
@@ -8,6 +11,69 @@
 #define STACK_SIZE    16
 #define NUM_KEYS      16
 
+/* Returned by get_key when no key is down yet, Fx0A retries next frame */
+#define CHIP8_KEY_NONE NUM_KEYS
+
+/* Sizes above are powers of two so accesses can be masked instead of checked */
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define STACK_MASK  (STACK_SIZE - 1)
+
+/* Timing models */
+#define CHIP8_TIMING_FIXED 0 /* Every opcode costs one cycle */
+#define CHIP8_TIMING_VIP   1 /* COSMAC VIP interpreter cycle costs */
+
+/* COSMAC VIP at 1.7609 MHz, 8 clocks per machine cycle, 60 Hz frames.
+   Display DMA and the frame interrupt take their share of every frame. */
+#define VIP_CYCLES_PER_FRAME 3668
+#define VIP_CYCLES_DMA       1024
+#define VIP_CYCLES_INTERRUPT 46
+
+/* Largest memory of any machine mode, trap tables cover all of it */
+#define CHIP8_ADDR_SPACE 65536
+
+/* Instances are cache line aligned, also within a pool */
+#define CHIP8_ALIGN 64
+
+/* Debugger trap bits, one byte per memory address */
+#define CHIP8_TRAP_EXEC  0x01
+#define CHIP8_TRAP_READ  0x02
+#define CHIP8_TRAP_WRITE 0x04
+#define CHIP8_TRAP_STEP  0x08
+
+/* Opcode classes, used to index the cost tables */
+enum
+{
+    OP_CLS,
+    OP_RET,
+    OP_SYS,
+    OP_JP,
+    OP_CALL,
+    OP_SE_BYTE,
+    OP_SE_REG,
+    OP_SKIP,
+    OP_LD_BYTE,
+    OP_ADD_BYTE,
+    OP_ALU,
+    OP_LD_I,
+    OP_JP_V0,
+    OP_RND,
+    OP_DRW,
+    OP_DRW_ROW,
+    OP_DRW_SHIFT,
+    OP_DRW_SPLIT,
+    OP_SKP,
+    OP_LD_TIMER,
+    OP_LD_K,
+    OP_ADD_I,
+    OP_LD_F,
+    OP_LD_B,
+    OP_LD_REGS,
+    OP_LD_REGS_EACH,
+    NUM_OPS
+};
+
+struct chip8_ext;
+
 struct chip8
 {
     unsigned char memory[MEMORY_SIZE];
@@ -16,6 +82,7 @@ struct chip8
     unsigned short pc;
 
     unsigned char screen[SCREEN_SIZE];
+    unsigned char dirty; /* Set when screen changes, cleared by the frontend */
 
     unsigned char delay_timer;
     unsigned char sound_timer;
@@ -25,13 +92,63 @@ struct chip8
 
     unsigned char key[NUM_KEYS];
 
+    /* Memory as the program sees it, either memory[] or the extended
+       mode's larger memory. mem_mask + 1 is its size. */
+    unsigned char *mem;
+    unsigned int mem_mask;
+
+    /* SUPER-CHIP/XO-CHIP state, NULL on the base machine */
+    struct chip8_ext *ext;
+
+    /* Timing: each opcode adds cost[] to cycles, and a frame ends once
+       cycle_budget is reached. Paced frames run at 60 Hz. */
+    unsigned char timing;
+    unsigned char paced;
+    const unsigned short *cost;
+    unsigned int cycle_budget;
+    unsigned int cycles;
+
+    /* Set when the program hit an opcode it can't run. A halted instance
+       keeps pc on that opcode and its frames do nothing. */
+    unsigned char halted;
+
+    /* Counters for the frontend to read and reset */
+    unsigned long long instructions;
+    unsigned long long draws;
+
     /* Callbacks */
     int (*end_of_cycle) (struct chip8 *op_chip, char redraw);
     char (*get_key) (struct chip8 *op_chip);
 
     void *ctx;
+
+    /* Debugger traps. trap points at a shared all-zero table unless a
+       debugger is attached, so the run loop never walks a breakpoint list. */
+    unsigned char *trap;
+    void (*trap_handler) (struct chip8 *op_chip, unsigned char kind, unsigned short addr);
+    void *trap_ctx;
+} __attribute__((aligned(CHIP8_ALIGN)));
+
+/* Many instances carved out of one huge page backed mapping */
+struct chip8_pool
+{
+    void *base;
+    size_t size;
+    size_t count;
 };
 
 void chip8_initialize_system(struct chip8 *op_chip);
 void chip8_load_program(struct chip8 *op_chip, char* buffer, size_t buf_size);
 void chip8_run(struct chip8 *op_chip);
+char chip8_run_frame(struct chip8 *op_chip);
+void chip8_halt(struct chip8 *op_chip, unsigned short opcode);
+void chip8_set_timing(struct chip8 *op_chip, unsigned char timing, unsigned int ipf);
+void chip8_attach_traps(struct chip8 *op_chip, unsigned char *trap,
+                        void (*handler) (struct chip8 *op_chip, unsigned char kind, unsigned short addr),
+                        void *ctx);
+
+int chip8_pool_create(struct chip8_pool *pool, size_t count);
+struct chip8 *chip8_pool_get(struct chip8_pool *pool, size_t index);
+void chip8_pool_destroy(struct chip8_pool *pool);
+
+#endif
@@ -0,0 +1,432 @@
+#include "chip8_ext.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 8x10 digits 0 - F for Fx30 */
+static const unsigned char bigfont[160] =
+{
+  0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+  0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+  0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+  0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+  0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+  0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+  0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+  0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+  0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+  0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+  0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+  0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+/* Switch between the base machine and SUPER-CHIP or XO-CHIP. Call after
+   chip8_initialize_system and before loading the program. Switching back
+   to CHIP8_MODE_CHIP8 frees the extended state, do that before
+   initializing the instance again. */
+int chip8_set_mode(struct chip8 *op_chip, unsigned char mode)
+{
+    struct chip8_ext *ext = op_chip->ext;
+
+    if(mode == CHIP8_MODE_CHIP8)
+    {
+        free(ext);
+        op_chip->ext = NULL;
+        op_chip->mem = op_chip->memory;
+        op_chip->mem_mask = MEMORY_MASK;
+        op_chip->dirty = 1;
+        return 0;
+    }
+
+    if(ext == NULL && posix_memalign((void **) &ext, CHIP8_ALIGN, sizeof(struct chip8_ext)))
+    {
+        return 1;
+    }
+    memset(ext, 0, sizeof(struct chip8_ext));
+    ext->mode = mode;
+    ext->selected = 1;
+
+    memcpy(op_chip->memory + EXT_BIGFONT_ADDR, bigfont, sizeof(bigfont));
+    if(mode == CHIP8_MODE_XO)
+    {
+        memcpy(ext->memory, op_chip->memory, MEMORY_SIZE * sizeof(unsigned char));
+        op_chip->mem = ext->memory;
+        op_chip->mem_mask = XO_MEMORY_SIZE - 1;
+    }
+    else
+    {
+        op_chip->mem = op_chip->memory;
+        op_chip->mem_mask = MEMORY_MASK;
+    }
+
+    op_chip->ext = ext;
+    op_chip->dirty = 1;
+    return 0;
+}
+
+// Expand extended planes to one byte per pixel, bit n set for plane n
+void chip8_ext_render(struct chip8 *op_chip, unsigned char *out)
+{
+    struct chip8_ext *ext = op_chip->ext;
+
+    memset(out, 0, EXT_SIZE * sizeof(unsigned char));
+    for(int p = 0; p < EXT_PLANES; p++)
+    {
+        for(int y = 0; y < EXT_HEIGHT; y++)
+        {
+            chip8_row row = ext->planes[p][y];
+            if(row == 0)
+            {
+                continue;
+            }
+            for(int x = 0; x < EXT_WIDTH; x++)
+            {
+                out[y * EXT_WIDTH + x] |= ((row >> (EXT_WIDTH - 1 - x)) & 1) << p;
+            }
+        }
+    }
+}
+
+static inline unsigned char _ext_read(struct chip8 *op_chip, unsigned int addr)
+{
+    addr &= op_chip->mem_mask;
+    if(op_chip->trap[addr] & CHIP8_TRAP_READ)
+    {
+        op_chip->trap_handler(op_chip, CHIP8_TRAP_READ, addr);
+    }
+    return op_chip->mem[addr];
+}
+
+static inline void _ext_write(struct chip8 *op_chip, unsigned int addr, unsigned char value)
+{
+    addr &= op_chip->mem_mask;
+    if(op_chip->trap[addr] & CHIP8_TRAP_WRITE)
+    {
+        op_chip->trap_handler(op_chip, CHIP8_TRAP_WRITE, addr);
+    }
+    op_chip->mem[addr] = value;
+}
+
+// Double every bit of a 16 bit sprite row, for low resolution drawing
+static inline unsigned int _ext_double(unsigned int bits)
+{
+    bits = (bits | bits << 8) & 0x00FF00FF;
+    bits = (bits | bits << 4) & 0x0F0F0F0F;
+    bits = (bits | bits << 2) & 0x33333333;
+    bits = (bits | bits << 1) & 0x55555555;
+    return bits | bits << 1;
+}
+
+/* Scroll the selected planes n rows, down if n is positive. Rows are
+   moved whole. */
+static void _ext_scroll_vertical(struct chip8_ext *ext, int n)
+{
+    for(int p = 0; p < EXT_PLANES; p++)
+    {
+        chip8_row *plane = ext->planes[p];
+        if(!(ext->selected & (1 << p)))
+        {
+            continue;
+        }
+        if(n > 0)
+        {
+            memmove(plane + n, plane, (EXT_HEIGHT - n) * sizeof(chip8_row));
+            memset(plane, 0, n * sizeof(chip8_row));
+        }
+        else
+        {
+            memmove(plane, plane - n, (EXT_HEIGHT + n) * sizeof(chip8_row));
+            memset(plane + EXT_HEIGHT + n, 0, -n * sizeof(chip8_row));
+        }
+    }
+}
+
+/* Scroll the selected planes n pixels, right if n is positive. Each row
+   is shifted as one 128 bit value. */
+static void _ext_scroll_horizontal(struct chip8_ext *ext, int n)
+{
+    for(int p = 0; p < EXT_PLANES; p++)
+    {
+        if(!(ext->selected & (1 << p)))
+        {
+            continue;
+        }
+#ifdef __SSE2__
+        __m128i *rows = (__m128i *) ext->planes[p];
+        __m128i count = _mm_cvtsi32_si128(n > 0 ? n : -n);
+        __m128i carry = _mm_cvtsi32_si128(64 - (n > 0 ? n : -n));
+
+        // The low 64 bit lane holds the right half of the row
+        if(n > 0)
+        {
+            for(int y = 0; y < EXT_HEIGHT; y++)
+            {
+                __m128i v = _mm_load_si128(rows + y);
+                _mm_store_si128(rows + y, _mm_or_si128(_mm_srl_epi64(v, count),
+                                                       _mm_sll_epi64(_mm_srli_si128(v, 8), carry)));
+            }
+        }
+        else
+        {
+            for(int y = 0; y < EXT_HEIGHT; y++)
+            {
+                __m128i v = _mm_load_si128(rows + y);
+                _mm_store_si128(rows + y, _mm_or_si128(_mm_sll_epi64(v, count),
+                                                       _mm_srl_epi64(_mm_slli_si128(v, 8), carry)));
+            }
+        }
+#else
+        chip8_row *plane = ext->planes[p];
+        for(int y = 0; y < EXT_HEIGHT; y++)
+        {
+            plane[y] = n > 0 ? plane[y] >> n : plane[y] << -n;
+        }
+#endif
+    }
+}
+
+void chip8_ext_clear(struct chip8 *op_chip)
+{
+    struct chip8_ext *ext = op_chip->ext;
+
+    for(int p = 0; p < EXT_PLANES; p++)
+    {
+        if(ext->selected & (1 << p))
+        {
+            memset(ext->planes[p], 0, sizeof(ext->planes[p]));
+        }
+    }
+    op_chip->dirty = 1;
+}
+
+/* Dxyn on the extended display. Each sprite row is masked into place as a
+   whole display row. Sprites clip at the edges, and every selected plane
+   takes its own sprite data from I onwards. Returns the new VF. */
+unsigned char chip8_ext_draw(struct chip8 *op_chip, unsigned int vx, unsigned int vy, unsigned int n)
+{
+    struct chip8_ext *ext = op_chip->ext;
+    unsigned int scale = ext->hires ? 1 : 2;
+    unsigned int x = (vx * scale) & (EXT_WIDTH - 1);
+    unsigned int y = (vy * scale) & (EXT_HEIGHT - 1);
+    unsigned int rows = n ? n : 16;
+    unsigned int width = n == 0 && (ext->hires || ext->mode == CHIP8_MODE_XO) ? 16 : 8;
+    unsigned int shift = EXT_WIDTH - width * scale;
+    unsigned int addr = op_chip->I;
+    unsigned char collision = 0;
+
+    for(int p = 0; p < EXT_PLANES; p++)
+    {
+        chip8_row *plane = ext->planes[p];
+        if(!(ext->selected & (1 << p)))
+        {
+            continue;
+        }
+
+        for(unsigned int r = 0; r < rows; r++)
+        {
+            unsigned int bits = _ext_read(op_chip, addr++);
+            if(width == 16)
+            {
+                bits = bits << 8 | _ext_read(op_chip, addr++);
+            }
+            if(scale == 2)
+            {
+                bits = _ext_double(bits);
+            }
+
+            chip8_row sprite = (chip8_row) bits << shift >> x;
+            for(unsigned int k = 0; k < scale; k++)
+            {
+                unsigned int line = y + r * scale + k;
+                if(line < EXT_HEIGHT)
+                {
+                    collision |= (plane[line] & sprite) != 0;
+                    plane[line] ^= sprite;
+                }
+            }
+        }
+    }
+
+    op_chip->dirty = 1;
+    return collision;
+}
+
+// Size of the instruction a skip jumps over, F000 nnnn is 4 bytes
+unsigned short chip8_ext_skip(struct chip8 *op_chip)
+{
+    unsigned int next = (op_chip->pc + 2) & op_chip->mem_mask;
+
+    if(op_chip->ext->mode != CHIP8_MODE_XO)
+    {
+        return 2;
+    }
+    return op_chip->mem[next] == 0xF0 && op_chip->mem[(next + 1) & op_chip->mem_mask] == 0x00 ? 4 : 2;
+}
+
+/* Opcodes the base machine doesn't know. Advances pc unless the program
+   halted. */
+int chip8_ext_exec(struct chip8 *op_chip, unsigned short opcode)
+{
+    struct chip8_ext *ext = op_chip->ext;
+    unsigned int x = (opcode & 0x0F00) >> 8;
+    unsigned int y = (opcode & 0x00F0) >> 4;
+    unsigned int scale = ext->hires ? 1 : 2;
+    char xo = ext->mode == CHIP8_MODE_XO;
+
+    switch(opcode & 0xF000)
+    {
+        case 0x0000:
+            if((opcode & 0xFFF0) == 0x00C0) // 0x00Cn - SCD nibble
+            {
+                // Scroll down n lines
+                _ext_scroll_vertical(ext, (opcode & 0x000F) * scale);
+                op_chip->dirty = 1;
+                break;
+            }
+            if(xo && (opcode & 0xFFF0) == 0x00D0) // 0x00Dn - SCU nibble
+            {
+                // Scroll up n lines
+                _ext_scroll_vertical(ext, -(int) ((opcode & 0x000F) * scale));
+                op_chip->dirty = 1;
+                break;
+            }
+            switch(opcode)
+            {
+                case 0x00FB: // 0x00FB - SCR
+                    // Scroll right 4 pixels
+                    _ext_scroll_horizontal(ext, 4 * scale);
+                    op_chip->dirty = 1;
+                    break;
+
+                case 0x00FC: // 0x00FC - SCL
+                    // Scroll left 4 pixels
+                    _ext_scroll_horizontal(ext, -4 * (int) scale);
+                    op_chip->dirty = 1;
+                    break;
+
+                case 0x00FD: // 0x00FD - EXIT
+                    // Stop the program, pc stays here
+                    return EXT_HALT;
+
+                case 0x00FE: // 0x00FE - LOW
+                case 0x00FF: // 0x00FF - HIGH
+                    // Switch resolution and clear the display
+                    ext->hires = opcode & 0x0001;
+                    memset(ext->planes, 0, sizeof(ext->planes));
+                    op_chip->dirty = 1;
+                    break;
+
+                default:
+                    return EXT_UNKNOWN;
+            }
+            break;
+
+        case 0x5000:
+            if(!xo)
+            {
+                return EXT_UNKNOWN;
+            }
+            switch(opcode & 0x000F)
+            {
+                case 0x0002: // 0x5xy2 - LD [I], Vx - Vy
+                    // Stores Vx through Vy, in either order, starting at I
+                    for(unsigned int i = 0; i <= (x > y ? x - y : y - x); i++)
+                    {
+                        _ext_write(op_chip, op_chip->I + i, op_chip->V[x > y ? x - i : x + i]);
+                    }
+                    break;
+
+                case 0x0003: // 0x5xy3 - LD Vx - Vy, [I]
+                    // Reads Vx through Vy, in either order, starting at I
+                    for(unsigned int i = 0; i <= (x > y ? x - y : y - x); i++)
+                    {
+                        op_chip->V[x > y ? x - i : x + i] = _ext_read(op_chip, op_chip->I + i);
+                    }
+                    break;
+
+                default:
+                    return EXT_UNKNOWN;
+            }
+            break;
+
+        case 0xF000:
+            if(xo && opcode == 0xF000) // 0xF000 nnnn - LD I, long addr
+            {
+                // Sets I to the 16 bit address in the next word
+                op_chip->I = op_chip->mem[(op_chip->pc + 2) & op_chip->mem_mask] << 8 |
+                             op_chip->mem[(op_chip->pc + 3) & op_chip->mem_mask];
+                op_chip->pc += 4;
+                return EXT_DONE;
+            }
+            switch(opcode & 0x00FF)
+            {
+                case 0x0001: // 0xFn01 - PLANE n
+                    // Selects the planes that draw, clear and scroll
+                    if(!xo)
+                    {
+                        return EXT_UNKNOWN;
+                    }
+                    ext->selected = x;
+                    break;
+
+                case 0x0002: // 0xF002 - AUDIO
+                    // Loads the 16 byte audio pattern from I
+                    if(!xo)
+                    {
+                        return EXT_UNKNOWN;
+                    }
+                    for(int i = 0; i < 16; i++)
+                    {
+                        ext->pattern[i] = _ext_read(op_chip, op_chip->I + i);
+                    }
+                    break;
+
+                case 0x0030: // 0xFx30 - LD HF, Vx
+                    // Set I to the location of the big sprite for digit Vx
+                    op_chip->I = EXT_BIGFONT_ADDR + 10 * (op_chip->V[x] & 0x0F);
+                    break;
+
+                case 0x003A: // 0xFx3A - PITCH Vx
+                    // Sets the audio pattern playback rate
+                    if(!xo)
+                    {
+                        return EXT_UNKNOWN;
+                    }
+                    ext->pitch = op_chip->V[x];
+                    break;
+
+                case 0x0075: // 0xFx75 - LD R, Vx
+                    // Stores V0 through Vx in the flag registers
+                    for(unsigned int i = 0; i <= x; i++)
+                    {
+                        ext->flags[i] = op_chip->V[i];
+                    }
+                    break;
+
+                case 0x0085: // 0xFx85 - LD Vx, R
+                    // Reads V0 through Vx from the flag registers
+                    for(unsigned int i = 0; i <= x; i++)
+                    {
+                        op_chip->V[i] = ext->flags[i];
+                    }
+                    break;
+
+                default:
+                    return EXT_UNKNOWN;
+            }
+            break;
+
+        default:
+            return EXT_UNKNOWN;
+    }
+
+    op_chip->pc += 2;
+    return EXT_DONE;
+}
@@ -0,0 +1,53 @@
+#ifndef CHIP8_EXT_H
+#define CHIP8_EXT_H
+
+#include "chip8.h"
+
+/* Machine modes */
+#define CHIP8_MODE_CHIP8 0
+#define CHIP8_MODE_SCHIP 1
+#define CHIP8_MODE_XO    2
+
+#define EXT_WIDTH   128
+#define EXT_HEIGHT  64
+#define EXT_SIZE    (EXT_WIDTH * EXT_HEIGHT)
+#define EXT_PLANES  4
+
+#define XO_MEMORY_SIZE 65536
+
+/* Where the 8x10 digits for Fx30 live, after the 4x5 font */
+#define EXT_BIGFONT_ADDR 0x50
+
+/* Results of chip8_ext_exec */
+#define EXT_UNKNOWN 0
+#define EXT_DONE    1
+#define EXT_HALT    2
+
+/* One display row, leftmost pixel in the most significant bit */
+typedef unsigned __int128 chip8_row;
+
+/* SUPER-CHIP and XO-CHIP state. Planes are always stored at 128x64;
+   low resolution pixels are drawn as 2x2 blocks. */
+struct chip8_ext
+{
+    chip8_row planes[EXT_PLANES][EXT_HEIGHT];
+    unsigned char memory[XO_MEMORY_SIZE];
+
+    unsigned char mode;
+    unsigned char hires;
+    unsigned char selected; /* Bit mask of planes that draw, clear and scroll */
+    unsigned char pitch;
+    unsigned char flags[NUM_REGISTERS];
+    unsigned char pattern[16];
+} __attribute__((aligned(CHIP8_ALIGN)));
+
+int chip8_set_mode(struct chip8 *op_chip, unsigned char mode);
+void chip8_ext_render(struct chip8 *op_chip, unsigned char *out);
+
+/* Called from chip8_run_frame when op_chip->ext is set */
+int chip8_ext_exec(struct chip8 *op_chip, unsigned short opcode);
+unsigned char chip8_ext_draw(struct chip8 *op_chip, unsigned int vx, unsigned int vy, unsigned int n);
+void chip8_ext_clear(struct chip8 *op_chip);
+unsigned short chip8_ext_skip(struct chip8 *op_chip);
+
+#endif
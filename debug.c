@@ -0,0 +1,326 @@
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Line protocol, one command per line, one reply line per command:
+   b <addr>             set breakpoint
+   bd <addr>            delete breakpoint
+   w <addr> [r|w|rw]    watch memory reads and/or writes (default w)
+   wd <addr>            delete watchpoint
+   rw <x> [value]       stop when Vx changes, or when it becomes value
+   rwd <x>              delete register condition
+   s [n]                step n instructions (default 1)
+   c                    continue
+   r                    print registers
+   x <addr> [len]       dump memory
+   q                    quit
+   Addresses and values are hex. When the emulator stops it prints
+   "stop <reason> ..." and waits for commands. */
+
+static void _debug_trap(struct chip8 *op_chip, unsigned char kind, unsigned short addr);
+
+int debug_attach(struct debugger *dbg, struct chip8 *op_chip, FILE *in, FILE *out)
+{
+    memset(dbg->trap, 0, CHIP8_ADDR_SPACE * sizeof(unsigned char));
+    memset(dbg->reg_watch, 0, NUM_REGISTERS * sizeof(unsigned char));
+    memcpy(dbg->reg_last, op_chip->V, NUM_REGISTERS * sizeof(unsigned char));
+    dbg->chip = op_chip;
+    dbg->in = in;
+    dbg->out = out;
+    dbg->hit_kind = 0;
+
+    // Stop before the first instruction
+    dbg->steps = 1;
+    dbg->armed = 1;
+    for(unsigned int i = 0; i <= op_chip->mem_mask; i++)
+    {
+        dbg->trap[i] = CHIP8_TRAP_STEP;
+    }
+
+    chip8_attach_traps(op_chip, dbg->trap, _debug_trap, dbg);
+    return 0;
+}
+
+// Wait for a client on a local socket and debug over it
+int debug_listen(struct debugger *dbg, struct chip8 *op_chip, const char *path)
+{
+    struct sockaddr_un addr;
+    int sock, fd;
+    FILE *in, *out;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        return 1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+    {
+        return 2;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, 1))
+    {
+        close(sock);
+        return 3;
+    }
+
+    fd = accept(sock, NULL, NULL);
+    close(sock);
+    if(fd < 0)
+    {
+        return 4;
+    }
+
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+    if(in == NULL || out == NULL)
+    {
+        return 5;
+    }
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    return debug_attach(dbg, op_chip, in, out);
+}
+
+void debug_detach(struct debugger *dbg)
+{
+    chip8_attach_traps(dbg->chip, NULL, NULL, NULL);
+}
+
+/* Set or clear the step bit on every address. Only needed while stepping,
+   watching registers or reporting a watchpoint hit. */
+static void _debug_arm(struct debugger *dbg)
+{
+    unsigned char step = dbg->steps || dbg->hit_kind;
+
+    for(int i = 0; i < NUM_REGISTERS; i++)
+    {
+        step |= dbg->reg_watch[i];
+    }
+    if(step == dbg->armed)
+    {
+        return;
+    }
+    dbg->armed = step;
+
+    // Only addresses the chip can reach, 4K unless it runs XO-CHIP
+    for(unsigned int i = 0; i <= dbg->chip->mem_mask; i++)
+    {
+        if(step)
+        {
+            dbg->trap[i] |= CHIP8_TRAP_STEP;
+        }
+        else
+        {
+            dbg->trap[i] &= ~CHIP8_TRAP_STEP;
+        }
+    }
+}
+
+static void _debug_print_registers(struct debugger *dbg)
+{
+    struct chip8 *op_chip = dbg->chip;
+
+    fprintf(dbg->out, "regs pc=0x%03X I=0x%03X sp=%d dt=%d st=%d",
+            op_chip->pc, op_chip->I, op_chip->sp, op_chip->delay_timer, op_chip->sound_timer);
+    for(int i = 0; i < NUM_REGISTERS; i++)
+    {
+        fprintf(dbg->out, " V%X=%02X", i, op_chip->V[i]);
+    }
+    fprintf(dbg->out, "\n");
+}
+
+// Read commands until the emulator should run again
+static void _debug_repl(struct debugger *dbg)
+{
+    struct chip8 *op_chip = dbg->chip;
+    char line[128];
+    char cmd[8], arg[8];
+    unsigned int a, b;
+    int n;
+
+    fflush(dbg->out);
+    while(fgets(line, sizeof(line), dbg->in) != NULL)
+    {
+        n = sscanf(line, "%7s %x %7s", cmd, &a, arg);
+        if(n < 1)
+        {
+            continue;
+        }
+
+        if(!strcmp(cmd, "c"))
+        {
+            fprintf(dbg->out, "ok\n");
+            fflush(dbg->out);
+            return;
+        }
+        else if(!strcmp(cmd, "s"))
+        {
+            dbg->steps = n >= 2 && a > 0 ? a : 1;
+            fprintf(dbg->out, "ok\n");
+            fflush(dbg->out);
+            return;
+        }
+        else if(!strcmp(cmd, "q"))
+        {
+            fprintf(dbg->out, "ok\n");
+            fflush(dbg->out);
+            exit(0);
+        }
+        else if(!strcmp(cmd, "r"))
+        {
+            _debug_print_registers(dbg);
+        }
+        else if(n < 2)
+        {
+            fprintf(dbg->out, "error missing argument\n");
+        }
+        else if(!strcmp(cmd, "b") || !strcmp(cmd, "bd"))
+        {
+            if(a > op_chip->mem_mask)
+            {
+                fprintf(dbg->out, "error bad address\n");
+            }
+            else
+            {
+                if(cmd[1] == 'd')
+                {
+                    dbg->trap[a] &= ~CHIP8_TRAP_EXEC;
+                }
+                else
+                {
+                    dbg->trap[a] |= CHIP8_TRAP_EXEC;
+                }
+                fprintf(dbg->out, "ok\n");
+            }
+        }
+        else if(!strcmp(cmd, "w") || !strcmp(cmd, "wd"))
+        {
+            unsigned char kind = CHIP8_TRAP_WRITE;
+            if(n >= 3)
+            {
+                kind = (strchr(arg, 'r') ? CHIP8_TRAP_READ : 0) | (strchr(arg, 'w') ? CHIP8_TRAP_WRITE : 0);
+            }
+            if(a > op_chip->mem_mask)
+            {
+                fprintf(dbg->out, "error bad address\n");
+            }
+            else
+            {
+                if(cmd[1] == 'd')
+                {
+                    dbg->trap[a] &= ~(CHIP8_TRAP_READ | CHIP8_TRAP_WRITE);
+                }
+                else
+                {
+                    dbg->trap[a] |= kind;
+                }
+                fprintf(dbg->out, "ok\n");
+            }
+        }
+        else if(!strcmp(cmd, "rw") || !strcmp(cmd, "rwd"))
+        {
+            if(a >= NUM_REGISTERS)
+            {
+                fprintf(dbg->out, "error bad register\n");
+            }
+            else
+            {
+                dbg->reg_watch[a] = cmd[2] != 'd';
+                dbg->reg_target[a] = n >= 3 ? (int) strtoul(arg, NULL, 16) : -1;
+                dbg->reg_last[a] = op_chip->V[a];
+                fprintf(dbg->out, "ok\n");
+            }
+        }
+        else if(!strcmp(cmd, "x"))
+        {
+            b = n >= 3 ? strtoul(arg, NULL, 16) : 16;
+            fprintf(dbg->out, "mem 0x%03X", a);
+            for(unsigned int i = 0; i < b && a + i <= op_chip->mem_mask; i++)
+            {
+                fprintf(dbg->out, " %02X", op_chip->mem[a + i]);
+            }
+            fprintf(dbg->out, "\n");
+        }
+        else
+        {
+            fprintf(dbg->out, "error unknown command\n");
+        }
+        fflush(dbg->out);
+    }
+
+    // Client went away, run at full speed without traps
+    debug_detach(dbg);
+}
+
+static void _debug_trap(struct chip8 *op_chip, unsigned char kind, unsigned short addr)
+{
+    struct debugger *dbg = (struct debugger *) op_chip->trap_ctx;
+    unsigned short opcode;
+    char stop = 0;
+
+    // Memory accesses are reported once the instruction has finished
+    if(kind & (CHIP8_TRAP_READ | CHIP8_TRAP_WRITE))
+    {
+        if(!dbg->hit_kind)
+        {
+            dbg->hit_kind = kind;
+            dbg->hit_addr = addr;
+            dbg->hit_old = op_chip->mem[addr];
+            _debug_arm(dbg);
+        }
+        return;
+    }
+
+    opcode = op_chip->mem[addr] << 8 | op_chip->mem[(addr + 1) & op_chip->mem_mask];
+
+    if(dbg->hit_kind)
+    {
+        fprintf(dbg->out, "stop watch %s addr=0x%03X old=%02X new=%02X pc=0x%03X op=0x%04X\n",
+                dbg->hit_kind == CHIP8_TRAP_READ ? "r" : "w", dbg->hit_addr,
+                dbg->hit_old, op_chip->mem[dbg->hit_addr], addr, opcode);
+        dbg->hit_kind = 0;
+        stop = 1;
+    }
+
+    if(dbg->trap[addr] & CHIP8_TRAP_EXEC)
+    {
+        fprintf(dbg->out, "stop break pc=0x%03X op=0x%04X\n", addr, opcode);
+        stop = 1;
+    }
+
+    for(int i = 0; i < NUM_REGISTERS; i++)
+    {
+        if(dbg->reg_watch[i] && op_chip->V[i] != dbg->reg_last[i] &&
+           (dbg->reg_target[i] < 0 || op_chip->V[i] == dbg->reg_target[i]))
+        {
+            fprintf(dbg->out, "stop reg V%X old=%02X new=%02X pc=0x%03X op=0x%04X\n",
+                    i, dbg->reg_last[i], op_chip->V[i], addr, opcode);
+            stop = 1;
+        }
+        dbg->reg_last[i] = op_chip->V[i];
+    }
+
+    if(dbg->steps && --dbg->steps == 0 && !stop)
+    {
+        fprintf(dbg->out, "stop step pc=0x%03X op=0x%04X\n", addr, opcode);
+        stop = 1;
+    }
+
+    if(stop)
+    {
+        dbg->steps = 0;
+        _debug_repl(dbg);
+    }
+    _debug_arm(dbg);
+}
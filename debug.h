@@ -0,0 +1,39 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "chip8.h"
+
+#include <stdio.h>
+
+struct debugger
+{
+    struct chip8 *chip;
+    FILE *in;
+    FILE *out;
+
+    /* Trap bits for every address, installed as the chip's trap table */
+    unsigned char trap[CHIP8_ADDR_SPACE];
+
+    /* Instructions left until a single-step stop, 0 if not stepping */
+    unsigned int steps;
+
+    /* Whether the step bit is currently set on every address */
+    unsigned char armed;
+
+    /* Register conditions. reg_target is -1 to stop on any change of Vx,
+       otherwise stop when Vx becomes that value. */
+    unsigned char reg_watch[NUM_REGISTERS];
+    int reg_target[NUM_REGISTERS];
+    unsigned char reg_last[NUM_REGISTERS];
+
+    /* Memory watchpoint hit, reported at the next instruction boundary */
+    unsigned char hit_kind;
+    unsigned short hit_addr;
+    unsigned char hit_old;
+};
+
+int debug_attach(struct debugger *dbg, struct chip8 *op_chip, FILE *in, FILE *out);
+int debug_listen(struct debugger *dbg, struct chip8 *op_chip, const char *path);
+void debug_detach(struct debugger *dbg);
+
+#endif
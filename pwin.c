@@ -1,11 +1,61 @@
 #include "pwin.h"
+#include "chip8.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define GET_RED(x) (((x) & 0x30) << 2)
 #define GET_GREEN(x) (((x) & 0x0C) << 4)
 #define GET_BLUE(x) (((x) & 0x03) << 6)
 
+/* Expand a two bit channel from the macros above to eight bits */
+#define EXPAND(x) ((x) | (x) >> 2 | (x) >> 4 | (x) >> 6)
+
+#define OVERLAY_SCALE 2
+
+/* Default tile colours as RRGGBB, 0 is the background */
+static const unsigned char _pwin_palette[16] =
+{
+    0x00, 0x3F, 0x2A, 0x15, 0x30, 0x0C, 0x03, 0x3C,
+    0x33, 0x0F, 0x20, 0x08, 0x02, 0x28, 0x0A, 0x22
+};
+
+/* 3x5 overlay font, one row per byte, bit 2 is the leftmost pixel */
+static const unsigned char _pwin_digits[10][5] =
+{
+    {7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+    {7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7}
+};
+
+static const unsigned char _pwin_letters[26][5] =
+{
+    {2, 5, 7, 5, 5}, {6, 5, 6, 5, 6}, {3, 4, 4, 4, 3}, {6, 5, 5, 5, 6}, {7, 4, 6, 4, 7},
+    {7, 4, 6, 4, 4}, {3, 4, 5, 5, 3}, {5, 5, 7, 5, 5}, {7, 2, 2, 2, 7}, {1, 1, 1, 5, 2},
+    {5, 5, 6, 5, 5}, {4, 4, 4, 4, 7}, {5, 7, 7, 5, 5}, {6, 5, 5, 5, 5}, {2, 5, 5, 5, 2},
+    {6, 5, 6, 4, 4}, {2, 5, 5, 6, 3}, {6, 5, 6, 5, 5}, {3, 4, 2, 1, 6}, {7, 2, 2, 2, 2},
+    {5, 5, 5, 5, 7}, {5, 5, 5, 5, 2}, {5, 5, 7, 7, 5}, {5, 5, 2, 5, 5}, {5, 5, 2, 2, 2},
+    {7, 1, 2, 4, 7}
+};
+
+static const unsigned char _pwin_dot[5] = {0, 0, 0, 0, 2};
+
+/* chip8 key for every scancode, shared by polling and waiting */
+static unsigned char _pwin_keymap[SDL_NUM_SCANCODES];
+
+/* Default layout, the left hand block of a QWERTY keyboard:
+   1 2 3 4      1 2 3 C
+   Q W E R  ->  4 5 6 D
+   A S D F      7 8 9 E
+   Z X C V      A 0 B F */
+static const SDL_Scancode _pwin_default_keys[16] =
+{
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V
+};
+
 int pwin_init(struct pixel_window *pwin)
 {
     if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) != 0)
@@ -27,9 +77,64 @@ int pwin_init(struct pixel_window *pwin)
 
     pwin->win = win;
     pwin->ren = ren;
+    pwin->overlay_lines = 0;
+
+    memset(_pwin_keymap, PWIN_KEY_UNMAPPED, sizeof(_pwin_keymap));
+    for(int i = 0; i < 16; i++)
+    {
+        _pwin_keymap[_pwin_default_keys[i]] = i;
+    }
     return 0;
 }
 
+// Draw the overlay text in the top left corner with one batched call
+static void _pwin_draw_overlay(struct pixel_window *pwin)
+{
+    SDL_Rect rects[PWIN_OVERLAY_WIDTH * 15];
+    const unsigned char *glyph;
+    int count;
+
+    SDL_SetRenderDrawColor(pwin->ren, 0xFF, 0xFF, 0x00, 0xFF);
+    for(int line = 0; line < pwin->overlay_lines; line++)
+    {
+        count = 0;
+        for(int c = 0; pwin->overlay[line][c] != '\0'; c++)
+        {
+            char ch = pwin->overlay[line][c];
+            if(ch >= '0' && ch <= '9')
+            {
+                glyph = _pwin_digits[ch - '0'];
+            }
+            else if(ch >= 'A' && ch <= 'Z')
+            {
+                glyph = _pwin_letters[ch - 'A'];
+            }
+            else if(ch == '.')
+            {
+                glyph = _pwin_dot;
+            }
+            else
+            {
+                continue;
+            }
+
+            for(int y = 0; y < 5; y++)
+            {
+                for(int x = 0; x < 3; x++)
+                {
+                    if(glyph[y] & (4 >> x))
+                    {
+                        SDL_Rect pixel = {(1 + c * 4 + x) * OVERLAY_SCALE, (1 + line * 6 + y) * OVERLAY_SCALE,
+                                          OVERLAY_SCALE, OVERLAY_SCALE};
+                        rects[count++] = pixel;
+                    }
+                }
+            }
+        }
+        SDL_RenderFillRects(pwin->ren, rects, count);
+    }
+}
+
 void pwin_draw_image(struct pixel_window *pwin, unsigned char* screen, int width, int height)
 {
     int s_width, s_height, x, y;
@@ -58,157 +163,206 @@ void pwin_draw_image(struct pixel_window *pwin, unsigned char* screen, int width
         pixel.y += s_height / height;
     }
 
+    _pwin_draw_overlay(pwin);
     SDL_RenderPresent(pwin->ren);
 }
 
+// Returns 1 once the window was asked to close
 int pwin_event_loop(unsigned char *keys)
 {
     SDL_Event e;
+    int quit = 0;
 
     while(SDL_PollEvent(&e) != 0)
     {
-        if(e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+        if(e.type == SDL_QUIT)
         {
-            int state;
-            if(e.type == SDL_KEYDOWN)
-            {
-                state = 1;
-            }
-            else if(e.type == SDL_KEYUP)
-            {
-                state = 0;
-            }
-            switch(e.key.keysym.sym)
+            quit = 1;
+        }
+        else if(e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+        {
+            unsigned char key = _pwin_keymap[e.key.keysym.scancode];
+            if(key != PWIN_KEY_UNMAPPED)
             {
-                case SDLK_1:
-                    keys[0x1] = state;
-                    break;
-                case SDLK_2:
-                    keys[0x2] = state;
-                    break;
-                case SDLK_3:
-                    keys[0x3] = state;
-                    break;
-                case SDLK_q:
-                    keys[0x4] = state;
-                    break;
-                case SDLK_w:
-                    keys[0x5] = state;
-                    break;
-                case SDLK_e:
-                    keys[0x6] = state;
-                    break;
-                case SDLK_a:
-                    keys[0x7] = state;
-                    break;
-                case SDLK_s:
-                    keys[0x8] = state;
-                    break;
-                case SDLK_d:
-                    keys[0x9] = state;
-                    break;
-                case SDLK_x:
-                    keys[0x0] = state;
-                    break;
-                case SDLK_z:
-                    keys[0xA] = state;
-                    break;
-                case SDLK_c:
-                    keys[0xB] = state;
-                    break;
-                case SDLK_4:
-                    keys[0xC] = state;
-                    break;
-                case SDLK_r:
-                    keys[0xD] = state;
-                    break;
-                case SDLK_f:
-                    keys[0xE] = state;
-                    break;
-                case SDLK_v:
-                    keys[0xF] = state;
-                    break;
+                keys[key] = e.type == SDL_KEYDOWN;
             }
         }
     }
-    return 0;
+    return quit;
 }
 
 char pwin_wait_for_key(unsigned char *keys)
 {
     SDL_Event e;
-    char done = 0;
-    char key;
 
-    while(!done && SDL_WaitEvent(&e))
+    while(SDL_WaitEvent(&e))
     {
         if(e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
         {
-            int state;
-            if(e.type == SDL_KEYDOWN)
+            unsigned char key = _pwin_keymap[e.key.keysym.scancode];
+            if(key == PWIN_KEY_UNMAPPED)
             {
-                state = 1;
-                done = 1;
+                continue;
             }
-            else if(e.type == SDL_KEYUP)
-            {
-                state = 0;
-            }
-            switch(e.key.keysym.sym)
+            keys[key] = e.type == SDL_KEYDOWN;
+            if(e.type == SDL_KEYDOWN)
             {
-                case SDLK_1:
-                    key = 0x1;
-                    break;
-                case SDLK_2:
-                    key = 0x2;
-                    break;
-                case SDLK_3:
-                    key = 0x3;
-                    break;
-                case SDLK_q:
-                    key = 0x4;
-                    break;
-                case SDLK_w:
-                    key = 0x5;
-                    break;
-                case SDLK_e:
-                    key = 0x6;
-                    break;
-                case SDLK_a:
-                    key = 0x7;
-                    break;
-                case SDLK_s:
-                    key = 0x8;
-                    break;
-                case SDLK_d:
-                    key = 0x9;
-                    break;
-                case SDLK_x:
-                    key = 0x0;
-                    break;
-                case SDLK_z:
-                    key = 0xA;
-                    break;
-                case SDLK_c:
-                    key = 0xB;
-                    break;
-                case SDLK_4:
-                    key = 0xC;
-                    break;
-                case SDLK_r:
-                    key = 0xD;
-                    break;
-                case SDLK_f:
-                    key = 0xE;
-                    break;
-                case SDLK_v:
-                    key = 0xF;
-                    break;
+                return key;
             }
-            keys[key] = state;
         }
     }
-    return key;
+    // No event to wait on, let Fx0A retry
+    return CHIP8_KEY_NONE;
+}
+
+/* Replace the key map with the one in path. Each line holds a hex chip8
+   key and an SDL scancode name, like "A Z" or "0 Keypad 0". Lines
+   starting with # are ignored. Keys not listed are left unmapped. */
+int pwin_load_keymap(const char *path)
+{
+    FILE *fd = fopen(path, "r");
+    char line[64];
+    unsigned int key;
+    int name;
+
+    if(fd == NULL)
+    {
+        return 1;
+    }
+
+    memset(_pwin_keymap, PWIN_KEY_UNMAPPED, sizeof(_pwin_keymap));
+    while(fgets(line, sizeof(line), fd) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '#' || sscanf(line, "%x %n", &key, &name) != 1 || line[name] == '\0')
+        {
+            continue;
+        }
+
+        SDL_Scancode code = SDL_GetScancodeFromName(line + name);
+        if(key >= 16 || code == SDL_SCANCODE_UNKNOWN)
+        {
+            fclose(fd);
+            return 2;
+        }
+        _pwin_keymap[code] = key;
+    }
+
+    fclose(fd);
+    return 0;
+}
+
+// Lay count tiles out in a roughly square grid inside one texture
+int pwin_tiles_init(struct pixel_window *pwin, struct pixel_tiles *tiles, int count, int tile_width, int tile_height)
+{
+    int cols = 1;
+
+    while(cols * cols < count)
+    {
+        cols++;
+    }
+
+    tiles->count = count;
+    tiles->cols = cols;
+    tiles->rows = (count + cols - 1) / cols;
+    tiles->tile_width = tile_width;
+    tiles->tile_height = tile_height;
+    tiles->width = cols * tile_width;
+    tiles->height = tiles->rows * tile_height;
+    for(int i = 0; i < 16; i++)
+    {
+        tiles->palette[i] = 0xFF000000 | EXPAND(GET_RED(_pwin_palette[i])) << 16 |
+                            EXPAND(GET_GREEN(_pwin_palette[i])) << 8 | EXPAND(GET_BLUE(_pwin_palette[i]));
+    }
+
+    tiles->atlas = SDL_CreateTexture(pwin->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                     tiles->width, tiles->height);
+    if(tiles->atlas == NULL)
+    {
+        return 1;
+    }
+
+    tiles->pixels = malloc(tiles->width * tiles->height * sizeof(Uint32));
+    if(tiles->pixels == NULL)
+    {
+        SDL_DestroyTexture(tiles->atlas);
+        return 2;
+    }
+
+    // Start every tile black, uploaded by the first draw
+    for(int i = 0; i < tiles->width * tiles->height; i++)
+    {
+        tiles->pixels[i] = tiles->palette[0];
+    }
+    tiles->dirty = 1;
+
+    return 0;
+}
+
+// Convert one screen into its tile. Only call this for screens that changed.
+void pwin_tiles_update(struct pixel_tiles *tiles, int index, unsigned char *screen)
+{
+    Uint32 *tile = tiles->pixels + (index / tiles->cols) * tiles->tile_height * tiles->width +
+                   (index % tiles->cols) * tiles->tile_width;
+
+    for(int y = 0; y < tiles->tile_height; y++)
+    {
+        for(int x = 0; x < tiles->tile_width; x++)
+        {
+            tile[x] = tiles->palette[screen[x] & 0x0F];
+        }
+        tile += tiles->width;
+        screen += tiles->tile_width;
+    }
+    tiles->dirty = 1;
+}
+
+/* Upload every changed tile with one lock of the atlas, then draw the whole
+   grid with a single copy. Locked texture memory is write only, so the
+   full atlas is copied from pixels rather than just the changed tiles. */
+void pwin_tiles_draw(struct pixel_window *pwin, struct pixel_tiles *tiles)
+{
+    void *locked;
+    int pitch;
+
+    if(tiles->dirty && SDL_LockTexture(tiles->atlas, NULL, &locked, &pitch) == 0)
+    {
+        for(int y = 0; y < tiles->height; y++)
+        {
+            memcpy((Uint8 *) locked + y * pitch, tiles->pixels + y * tiles->width, tiles->width * sizeof(Uint32));
+        }
+        SDL_UnlockTexture(tiles->atlas);
+        tiles->dirty = 0;
+    }
+
+    SDL_RenderClear(pwin->ren);
+    SDL_RenderCopy(pwin->ren, tiles->atlas, NULL, NULL);
+    _pwin_draw_overlay(pwin);
+    SDL_RenderPresent(pwin->ren);
+}
+
+void pwin_tiles_close(struct pixel_tiles *tiles)
+{
+    SDL_DestroyTexture(tiles->atlas);
+    free(tiles->pixels);
+}
+
+// Show count lines of text, each starting pitch bytes after the last.
+// Lines longer than the overlay are cut short.
+void pwin_set_overlay(struct pixel_window *pwin, const char *lines, int pitch, int count)
+{
+    int width = pitch < PWIN_OVERLAY_WIDTH ? pitch : PWIN_OVERLAY_WIDTH - 1;
+
+    if(count > PWIN_OVERLAY_LINES)
+    {
+        count = PWIN_OVERLAY_LINES;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        strncpy(pwin->overlay[i], lines + i * pitch, width);
+        pwin->overlay[i][width] = '\0';
+    }
+    pwin->overlay_lines = count;
 }
 
 void pwin_close(struct pixel_window *pwin)
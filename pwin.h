@@ -1,13 +1,44 @@
 #include <SDL2/SDL.h>
 
+#define PWIN_KEY_UNMAPPED 0xFF
+
+#define PWIN_OVERLAY_LINES 8
+#define PWIN_OVERLAY_WIDTH 24
+
 struct pixel_window
 {
     SDL_Window *win;
     SDL_Renderer *ren;
+
+    /* Text drawn over the image, digits and capitals only */
+    char overlay[PWIN_OVERLAY_LINES][PWIN_OVERLAY_WIDTH];
+    int overlay_lines;
+};
+
+/* Many screens in a grid, kept in one texture atlas. Screens are
+   converted into pixels, a copy of the whole atlas, and uploaded together
+   once per frame. */
+struct pixel_tiles
+{
+    SDL_Texture *atlas;
+    Uint32 *pixels;
+    Uint32 palette[16]; /* Colour for each pixel value, for multi-plane screens */
+    int count;
+    int cols, rows;
+    int tile_width, tile_height;
+    int width, height;
+    int dirty; /* Set when pixels has changes the texture hasn't seen */
 };
 
 int pwin_init(struct pixel_window *pwin);
 void pwin_draw_image(struct pixel_window *pwin, unsigned char* screen, int width, int height);
 int pwin_event_loop(unsigned char *keys);
 char pwin_wait_for_key(unsigned char *keys);
+int pwin_load_keymap(const char *path);
+void pwin_set_overlay(struct pixel_window *pwin, const char *lines, int pitch, int count);
 void pwin_close(struct pixel_window *pwin);
+
+int pwin_tiles_init(struct pixel_window *pwin, struct pixel_tiles *tiles, int count, int tile_width, int tile_height);
+void pwin_tiles_update(struct pixel_tiles *tiles, int index, unsigned char *screen);
+void pwin_tiles_draw(struct pixel_window *pwin, struct pixel_tiles *tiles);
+void pwin_tiles_close(struct pixel_tiles *tiles);
@@ -0,0 +1,155 @@
+#include "stats.h"
+
+#include <string.h>
+#include <time.h>
+
+#define FRAME_NSEC 16666667ULL
+
+__thread struct stats_counters stats_thread;
+static __thread unsigned long long _stats_last_frame;
+static __thread unsigned long long _stats_blocked;
+
+unsigned long long stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Start counting. Reports go to out every interval_ms, out may be NULL.
+void stats_init(struct stats *st, FILE *out, unsigned int interval_ms)
+{
+    memset(st, 0, sizeof(struct stats));
+    st->out = out;
+    st->interval = interval_ms * 1000000ULL;
+    st->last_report = stats_now();
+}
+
+// Move an instance's own counters into this thread's counters
+void stats_count_chip(struct chip8 *op_chip)
+{
+    stats_thread.instructions += op_chip->instructions;
+    stats_thread.draws += op_chip->draws;
+    op_chip->instructions = 0;
+    op_chip->draws = 0;
+}
+
+// Account a presented frame whose drawing started at start
+void stats_draw(unsigned long long start)
+{
+    unsigned long long elapsed = stats_now() - start;
+    unsigned long long usec = elapsed / 1000;
+    int bucket = 0;
+
+    while(usec > 1 && bucket < STATS_LATENCY_BUCKETS - 1)
+    {
+        usec >>= 1;
+        bucket++;
+    }
+
+    stats_thread.draw_nsec += elapsed;
+    stats_thread.latency[bucket]++;
+    stats_thread.frames_presented++;
+}
+
+void stats_event(unsigned long long start)
+{
+    stats_thread.event_nsec += stats_now() - start;
+}
+
+// Account time the core spent blocked waiting for a key, which is not a
+// missed frame
+void stats_blocked(unsigned long long start)
+{
+    _stats_blocked += stats_now() - start;
+}
+
+static void _stats_add(unsigned long long *total, unsigned long long *count)
+{
+    __atomic_fetch_add(total, *count, __ATOMIC_RELAXED);
+    *count = 0;
+}
+
+static void _stats_report(struct stats *st, unsigned long long elapsed)
+{
+    struct stats_counters now, diff;
+    double sec = elapsed / 1e9;
+
+    memcpy(&now, &st->total, sizeof(struct stats_counters));
+    diff.instructions = now.instructions - st->reported.instructions;
+    diff.draws = now.draws - st->reported.draws;
+    diff.frames_presented = now.frames_presented - st->reported.frames_presented;
+    diff.frames_dropped = now.frames_dropped - st->reported.frames_dropped;
+    diff.draw_nsec = now.draw_nsec - st->reported.draw_nsec;
+    diff.event_nsec = now.event_nsec - st->reported.event_nsec;
+    for(int i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    {
+        diff.latency[i] = now.latency[i] - st->reported.latency[i];
+    }
+    memcpy(&st->reported, &now, sizeof(struct stats_counters));
+
+    snprintf(st->lines[0], STATS_LINE_WIDTH, "IPS %.0f", diff.instructions / sec);
+    snprintf(st->lines[1], STATS_LINE_WIDTH, "DRW %.0f", diff.draws / sec);
+    snprintf(st->lines[2], STATS_LINE_WIDTH, "FPS %.0f", diff.frames_presented / sec);
+    snprintf(st->lines[3], STATS_LINE_WIDTH, "DROP %.0f", diff.frames_dropped / sec);
+    snprintf(st->lines[4], STATS_LINE_WIDTH, "DRAW %.1f MS", diff.draw_nsec / sec / 1e6);
+    snprintf(st->lines[5], STATS_LINE_WIDTH, "EVT %.1f MS", diff.event_nsec / sec / 1e6);
+
+    if(st->out == NULL)
+    {
+        return;
+    }
+
+    // One JSON object per line, times in milliseconds per second of wall time
+    fprintf(st->out, "{\"ips\":%.0f,\"draws\":%.0f,\"presented\":%llu,\"dropped\":%llu,"
+            "\"draw_ms\":%.3f,\"event_ms\":%.3f,\"latency_us_log2\":[",
+            diff.instructions / sec, diff.draws / sec, diff.frames_presented, diff.frames_dropped,
+            diff.draw_nsec / sec / 1e6, diff.event_nsec / sec / 1e6);
+    for(int i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    {
+        fprintf(st->out, i ? ",%llu" : "%llu", diff.latency[i]);
+    }
+    fprintf(st->out, "]}\n");
+    fflush(st->out);
+}
+
+/* Call once per emulated frame. Folds this thread's counters into the
+   totals and returns 1 when a new report was made. */
+int stats_frame(struct stats *st)
+{
+    struct stats_counters *c = &stats_thread;
+    unsigned long long now = stats_now();
+    unsigned long long gap = now - _stats_last_frame - _stats_blocked;
+    unsigned long long last;
+
+    // Every whole refresh period missed since the last frame is a drop
+    if(_stats_last_frame && gap > FRAME_NSEC * 3 / 2)
+    {
+        c->frames_dropped += (gap + FRAME_NSEC / 2) / FRAME_NSEC - 1;
+    }
+    _stats_last_frame = now;
+    _stats_blocked = 0;
+
+    _stats_add(&st->total.instructions, &c->instructions);
+    _stats_add(&st->total.draws, &c->draws);
+    _stats_add(&st->total.frames_presented, &c->frames_presented);
+    _stats_add(&st->total.frames_dropped, &c->frames_dropped);
+    _stats_add(&st->total.draw_nsec, &c->draw_nsec);
+    _stats_add(&st->total.event_nsec, &c->event_nsec);
+    for(int i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    {
+        _stats_add(&st->total.latency[i], &c->latency[i]);
+    }
+
+    // Only one thread gets to write each report
+    last = __atomic_load_n(&st->last_report, __ATOMIC_RELAXED);
+    if(now - last < st->interval ||
+       !__atomic_compare_exchange_n(&st->last_report, &last, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    _stats_report(st, now - last);
+    return 1;
+}
@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "chip8.h"
+
+#include <stdio.h>
+
+/* Present latency histogram, bucket i counts [2^i, 2^(i+1)) microseconds */
+#define STATS_LATENCY_BUCKETS 16
+
+#define STATS_LINES      6
+#define STATS_LINE_WIDTH 24
+
+/* Counted by one thread without synchronization, folded into the shared
+   totals once per frame by stats_frame */
+struct stats_counters
+{
+    unsigned long long instructions;
+    unsigned long long draws;
+    unsigned long long frames_presented;
+    unsigned long long frames_dropped;
+    unsigned long long draw_nsec;
+    unsigned long long event_nsec;
+    unsigned long long latency[STATS_LATENCY_BUCKETS];
+};
+
+struct stats
+{
+    struct stats_counters total;
+    struct stats_counters reported;
+    unsigned long long last_report;
+    unsigned long long interval;
+    FILE *out;
+
+    /* Rates from the last report, formatted for an overlay */
+    char lines[STATS_LINES][STATS_LINE_WIDTH];
+};
+
+extern __thread struct stats_counters stats_thread;
+
+unsigned long long stats_now(void);
+void stats_init(struct stats *st, FILE *out, unsigned int interval_ms);
+void stats_count_chip(struct chip8 *op_chip);
+void stats_draw(unsigned long long start);
+void stats_event(unsigned long long start);
+void stats_blocked(unsigned long long start);
+int stats_frame(struct stats *st);
+
+#endif
@@ -1,41 +1,175 @@
 #include "chip8.h"
+#include "chip8_ext.h"
 #include "pwin.h"
+#include "debug.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
-char codez[3584];
+// Instructions per 60 Hz frame without VIP timing
+#define DEFAULT_IPF 10
+
+char codez[XO_MEMORY_SIZE - 0x200];
+
+// SUPER-CHIP and XO-CHIP screens are shown through a one tile atlas
+struct pixel_tiles ext_tiles;
+unsigned char ext_screen[EXT_SIZE];
+
+// Performance counters, only gathered with -o or -S
+struct stats stats;
+char stats_on = 0;
+char stats_overlay = 0;
 
 int update_chip(struct chip8 *chip, char redraw);
+void draw_screen(struct pixel_window *pwin, struct chip8 *chip);
 char wait_for_key(struct chip8 *chip);
+char poll_key(struct chip8 *chip);
+int run_tiled(struct pixel_window *pwin, int count, char **roms, int num_roms, char vip_timing, unsigned int ipf, unsigned char mode);
 
 int main(int argc, char* argv[])
 {
     struct chip8 chip;
     struct pixel_window pwin;
+    struct debugger dbg;
+    char debug_stdin = 0;
+    const char *debug_socket = NULL;
+    char vip_timing = 0;
+    int tiles = 0;
+    FILE *stats_file = NULL;
+    const char *keymap = NULL;
+    unsigned int ipf = DEFAULT_IPF;
+    unsigned char mode = CHIP8_MODE_CHIP8;
+    int opt;
 
     chip.end_of_cycle = update_chip;
     chip.get_key = wait_for_key;
     chip.ctx = (void *) &pwin;
 
-    if(argc != 2)
+    // -d debugs over stdin, -D path over a local socket, -v uses VIP timing,
+    // -t count runs that many instances of the given ROMs in a grid,
+    // -o shows performance stats on screen, -S path writes them to a file,
+    // -i sets instructions per frame, -k path loads a key map,
+    // -x schip|xo enables the extended instruction sets
+    while((opt = getopt(argc, argv, "dD:vt:oS:i:k:x:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                debug_stdin = 1;
+                break;
+            case 'D':
+                debug_socket = optarg;
+                break;
+            case 'v':
+                vip_timing = 1;
+                break;
+            case 't':
+                tiles = atoi(optarg);
+                break;
+            case 'i':
+                ipf = atoi(optarg);
+                break;
+            case 'k':
+                keymap = optarg;
+                break;
+            case 'x':
+                if(!strcmp(optarg, "schip"))
+                {
+                    mode = CHIP8_MODE_SCHIP;
+                }
+                else if(!strcmp(optarg, "xo"))
+                {
+                    mode = CHIP8_MODE_XO;
+                }
+                else
+                {
+                    exit(1);
+                }
+                break;
+            case 'o':
+                stats_on = 1;
+                stats_overlay = 1;
+                break;
+            case 'S':
+                stats_on = 1;
+                stats_file = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+                if(stats_file == NULL)
+                {
+                    exit(2);
+                }
+                break;
+            default:
+                exit(1);
+        }
+    }
+
+    if(stats_on)
+    {
+        stats_init(&stats, stats_file, 1000);
+    }
+
+    if(tiles > 0 && optind < argc)
+    {
+        if(pwin_init(&pwin))
+        {
+            exit(3);
+        }
+        if(keymap != NULL && pwin_load_keymap(keymap))
+        {
+            exit(2);
+        }
+        int result = run_tiled(&pwin, tiles, argv + optind, argc - optind, vip_timing, ipf, mode);
+        pwin_close(&pwin);
+        return result;
+    }
+
+    if(optind != argc - 1)
     {
         exit(1);
     }
-    FILE* fd = fopen(argv[1], "r");
+    FILE* fd = fopen(argv[optind], "r");
     if(fd == NULL)
     {
         exit(2);
     }
 
-    size_t program_length = fread(codez, sizeof(char), 3584, fd);
+    size_t program_length = fread(codez, sizeof(char), sizeof(codez), fd);
 
     if(pwin_init(&pwin))
     {
         exit(3);
     }
+    if(keymap != NULL && pwin_load_keymap(keymap))
+    {
+        exit(2);
+    }
 
+    // Input is sampled once per frame by update_chip
     chip8_initialize_system(&chip);
+    if(mode != CHIP8_MODE_CHIP8)
+    {
+        if(chip8_set_mode(&chip, mode) || pwin_tiles_init(&pwin, &ext_tiles, 1, EXT_WIDTH, EXT_HEIGHT))
+        {
+            exit(5);
+        }
+    }
     chip8_load_program(&chip, codez, program_length);
+    chip8_set_timing(&chip, vip_timing ? CHIP8_TIMING_VIP : CHIP8_TIMING_FIXED, ipf);
+
+    if(debug_socket != NULL)
+    {
+        if(debug_listen(&dbg, &chip, debug_socket))
+        {
+            exit(4);
+        }
+    }
+    else if(debug_stdin)
+    {
+        debug_attach(&dbg, &chip, stdin, stdout);
+    }
+
     chip8_run(&chip);
 
     if(fclose(fd))
@@ -43,20 +177,184 @@ int main(int argc, char* argv[])
         exit(3);
     }
 
-    return 0;
+    // chip8_run only returns once the program hit a bad opcode
+    return 1;
 }
 
 int update_chip(struct chip8 *chip, char redraw)
 {
+    struct pixel_window *pwin = (struct pixel_window *) chip->ctx;
+    unsigned long long start;
+
+    if(!stats_on)
+    {
+        if(redraw)
+        {
+            draw_screen(pwin, chip);
+        }
+        pwin_event_loop(chip->key);
+        return 0;
+    }
+
     if(redraw)
     {
-        pwin_draw_image((struct pixel_window *) chip->ctx, chip->screen, SCREEN_WIDTH, SCREEN_HEIGHT);
+        start = stats_now();
+        draw_screen(pwin, chip);
+        stats_draw(start);
     }
+    start = stats_now();
     pwin_event_loop(chip->key);
+    stats_event(start);
+
+    stats_count_chip(chip);
+    if(stats_frame(&stats) && stats_overlay)
+    {
+        pwin_set_overlay(pwin, stats.lines[0], STATS_LINE_WIDTH, STATS_LINES);
+    }
     return 0;
 }
 
+void draw_screen(struct pixel_window *pwin, struct chip8 *chip)
+{
+    if(chip->ext == NULL)
+    {
+        pwin_draw_image(pwin, chip->screen, SCREEN_WIDTH, SCREEN_HEIGHT);
+        return;
+    }
+    chip8_ext_render(chip, ext_screen);
+    pwin_tiles_update(&ext_tiles, 0, ext_screen);
+    pwin_tiles_draw(pwin, &ext_tiles);
+    chip->dirty = 0;
+}
+
 char wait_for_key(struct chip8 *chip)
 {
-    return pwin_wait_for_key(chip->key);
+    unsigned long long start;
+    char pressed;
+
+    if(!stats_on)
+    {
+        return pwin_wait_for_key(chip->key);
+    }
+
+    // Waiting for input stalls the frame, don't report it as dropped
+    start = stats_now();
+    pressed = pwin_wait_for_key(chip->key);
+    stats_blocked(start);
+    return pressed;
+}
+
+// Fx0A for tiled instances, which must not block the other screens.
+// Only a key that went down since the last frame counts as a press.
+char poll_key(struct chip8 *chip)
+{
+    unsigned char *held = (unsigned char *) chip->ctx;
+
+    for(int i = 0; i < NUM_KEYS; i++)
+    {
+        if(chip->key[i] && !held[i])
+        {
+            held[i] = 1;
+            return i;
+        }
+    }
+    return CHIP8_KEY_NONE;
+}
+
+// Run many instances in one thread and show them in one window
+int run_tiled(struct pixel_window *pwin, int count, char **roms, int num_roms, char vip_timing, unsigned int ipf, unsigned char mode)
+{
+    struct chip8_pool pool;
+    struct pixel_tiles tiles;
+    unsigned char keys[NUM_KEYS] = {0};
+    unsigned char (*held)[NUM_KEYS] = calloc(count, sizeof(*held));
+    int width = mode == CHIP8_MODE_CHIP8 ? SCREEN_WIDTH : EXT_WIDTH;
+    int height = mode == CHIP8_MODE_CHIP8 ? SCREEN_HEIGHT : EXT_HEIGHT;
+
+    if(held == NULL || chip8_pool_create(&pool, count))
+    {
+        exit(5);
+    }
+    if(pwin_tiles_init(pwin, &tiles, count, width, height))
+    {
+        exit(3);
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        struct chip8 *chip = chip8_pool_get(&pool, i);
+        FILE* fd = fopen(roms[i % num_roms], "r");
+        if(fd == NULL)
+        {
+            exit(2);
+        }
+        size_t program_length = fread(codez, sizeof(char), sizeof(codez), fd);
+        fclose(fd);
+
+        chip8_initialize_system(chip);
+        if(mode != CHIP8_MODE_CHIP8 && chip8_set_mode(chip, mode))
+        {
+            exit(5);
+        }
+        chip8_load_program(chip, codez, program_length);
+        chip8_set_timing(chip, vip_timing ? CHIP8_TIMING_VIP : CHIP8_TIMING_FIXED, ipf);
+        chip->get_key = poll_key;
+        chip->ctx = (void *) held[i];
+    }
+
+    // Presenting with vsync paces every instance to one frame per refresh
+    for(;;)
+    {
+        unsigned long long start = stats_on ? stats_now() : 0;
+        int quit = pwin_event_loop(keys);
+        if(stats_on)
+        {
+            stats_event(start);
+        }
+        if(quit)
+        {
+            break;
+        }
+
+        for(int i = 0; i < count; i++)
+        {
+            struct chip8 *chip = chip8_pool_get(&pool, i);
+            memcpy(chip->key, keys, NUM_KEYS * sizeof(unsigned char));
+            chip8_run_frame(chip);
+            memcpy(held[i], keys, NUM_KEYS * sizeof(unsigned char));
+            if(chip->dirty && chip->ext != NULL)
+            {
+                chip8_ext_render(chip, ext_screen);
+                pwin_tiles_update(&tiles, i, ext_screen);
+                chip->dirty = 0;
+            }
+            else if(chip->dirty)
+            {
+                pwin_tiles_update(&tiles, i, chip->screen);
+                chip->dirty = 0;
+            }
+            if(stats_on)
+            {
+                stats_count_chip(chip);
+            }
+        }
+
+        if(!stats_on)
+        {
+            pwin_tiles_draw(pwin, &tiles);
+            continue;
+        }
+        start = stats_now();
+        pwin_tiles_draw(pwin, &tiles);
+        stats_draw(start);
+        if(stats_frame(&stats) && stats_overlay)
+        {
+            pwin_set_overlay(pwin, stats.lines[0], STATS_LINE_WIDTH, STATS_LINES);
+        }
+    }
+
+    pwin_tiles_close(&tiles);
+    chip8_pool_destroy(&pool);
+    free(held);
+    return 0;
 }